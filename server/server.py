@@ -39,18 +39,24 @@ async def handle_websocket(ws, path):
         client_id = splitted.pop(0)
         print('Client {} connected'.format(client_id))
 
-        clients[client_id] = ws
+        # Several workers of the same chubby may connect with the same id
+        clients.setdefault(client_id, set()).add(ws)
         while True:
             data = await ws.recv()
             print('Client {} >> {}'.format(client_id, one_line(data)))
             message = Message.parse(data)
             dest_id = message.id
-            dest_ws = clients.get(dest_id)
-            if dest_ws is not None:
+            dest_ws_set = clients.get(dest_id)
+            if dest_ws_set:
                 message.id = client_id
                 data = str(message)
                 print('Client {} << {}'.format(dest_id, one_line(data)))
-                await dest_ws.send(data)
+                for dest_ws in list(dest_ws_set):
+                    try:
+                        await dest_ws.send(data)
+                    except Exception as e:
+                        # A stale worker connection must not disconnect the sender
+                        print('Client {} send failed: {}'.format(dest_id, e))
             else:
                 error = Message(dest_id, "error", ["not_found"])
                 data = str(error)
@@ -62,5 +68,8 @@ async def handle_websocket(ws, path):
 
     finally:
         if client_id:
-            del clients[client_id]
+            ws_set = clients.get(client_id, set())
+            ws_set.discard(ws)
+            if not ws_set:
+                clients.pop(client_id, None)
             print('Client {} disconnected'.format(client_id))
@@ -0,0 +1,243 @@
+/**
+ * Copyright (c) 2020 by Paul-Louis Ageneau
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "capture.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace chubby {
+
+namespace {
+
+const uint32_t PcapMagic = 0xa1b2c3d4;
+const uint32_t PcapSnapLen = 65535;
+const uint32_t PcapLinkTypeUser0 = 147;
+
+// The mapping grows by chunks so remapping stays off the hot path
+const size_t ChunkSize = 16 * 1024 * 1024;
+
+struct PcapHeader {
+	uint32_t magic;
+	uint16_t versionMajor;
+	uint16_t versionMinor;
+	int32_t thisZone;
+	uint32_t sigFigs;
+	uint32_t snapLen;
+	uint32_t network;
+};
+
+struct PcapRecordHeader {
+	uint32_t tsSec;
+	uint32_t tsUsec;
+	uint32_t inclLen;
+	uint32_t origLen;
+};
+
+struct PseudoHeader {
+	uint8_t direction;
+	uint8_t stream;
+	uint16_t idLength;
+};
+
+} // namespace
+
+Capture::Capture(const string &filename) {
+	mFile = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (mFile == -1)
+		throw std::runtime_error("Failed to open capture file " + filename);
+
+	try {
+		reserve(sizeof(PcapHeader));
+	} catch (...) {
+		::close(mFile);
+		throw;
+	}
+
+	PcapHeader header = {};
+	header.magic = PcapMagic;
+	header.versionMajor = 2;
+	header.versionMinor = 4;
+	header.snapLen = PcapSnapLen;
+	header.network = PcapLinkTypeUser0;
+	std::memcpy(mMap, &header, sizeof(header));
+	mOffset = sizeof(header);
+}
+
+Capture::~Capture() {
+	if (mMap)
+		munmap(mMap, mMapSize);
+
+	// Drop the unused tail of the last chunk
+	if (ftruncate(mFile, mOffset) == -1) {
+		// Ignore, readers stop on the zeroed tail anyway
+	}
+	::close(mFile);
+}
+
+void Capture::write(Direction direction, Stream stream, const string &id, const byte *data,
+                    size_t size) {
+	const size_t idLength = std::min(id.size(), size_t(PcapSnapLen) - sizeof(PseudoHeader));
+	const size_t length = std::min(sizeof(PseudoHeader) + idLength + size, size_t(PcapSnapLen));
+	const size_t origLength = sizeof(PseudoHeader) + idLength + size;
+
+	std::lock_guard lock(mMutex);
+	if (mFailed)
+		return;
+
+	try {
+		reserve(sizeof(PcapRecordHeader) + length);
+	} catch (const std::exception &e) {
+		// Never take the data path down because of the capture
+		std::cerr << "Capture disabled: " << e.what() << std::endl;
+		mFailed = true;
+		return;
+	}
+
+	using namespace std::chrono;
+	const auto now = duration_cast<microseconds>(system_clock::now().time_since_epoch());
+
+	PcapRecordHeader record;
+	record.tsSec = uint32_t(now.count() / 1000000);
+	record.tsUsec = uint32_t(now.count() % 1000000);
+	record.inclLen = uint32_t(length);
+	record.origLen = uint32_t(origLength);
+
+	PseudoHeader pseudo;
+	pseudo.direction = uint8_t(direction);
+	pseudo.stream = uint8_t(stream);
+	pseudo.idLength = htons(uint16_t(idLength));
+
+	byte *p = mMap + mOffset;
+	std::memcpy(p, &record, sizeof(record));
+	p += sizeof(record);
+	std::memcpy(p, &pseudo, sizeof(pseudo));
+	p += sizeof(pseudo);
+	std::memcpy(p, id.data(), idLength);
+	p += idLength;
+	std::memcpy(p, data, length - sizeof(pseudo) - idLength);
+
+	mOffset += sizeof(record) + length;
+}
+
+void Capture::reserve(size_t size) {
+	if (mOffset + size <= mMapSize)
+		return;
+
+	size_t newSize = mMapSize;
+	while (mOffset + size > newSize)
+		newSize += ChunkSize;
+
+	// Allocate actual blocks, writing to a sparse mapping on a full disk would raise SIGBUS
+	if (posix_fallocate(mFile, mMapSize, newSize - mMapSize) != 0)
+		throw std::runtime_error("Failed to extend capture file");
+
+	if (mMap)
+		munmap(mMap, mMapSize);
+
+	void *map = mmap(nullptr, newSize, PROT_READ | PROT_WRITE, MAP_SHARED, mFile, 0);
+	if (map == MAP_FAILED) {
+		mMap = nullptr;
+		mMapSize = 0;
+		throw std::runtime_error("Failed to map capture file");
+	}
+
+	mMap = static_cast<byte *>(map);
+	mMapSize = newSize;
+}
+
+CaptureReader::CaptureReader(const string &filename) {
+	mFile = ::open(filename.c_str(), O_RDONLY);
+	if (mFile == -1)
+		throw std::runtime_error("Failed to open capture file " + filename);
+
+	try {
+		struct stat st;
+		if (fstat(mFile, &st) == -1)
+			throw std::runtime_error("Failed to stat capture file");
+
+		mMapSize = size_t(st.st_size);
+		if (mMapSize < sizeof(PcapHeader))
+			throw std::runtime_error("Capture file is truncated");
+
+		void *map = mmap(nullptr, mMapSize, PROT_READ, MAP_PRIVATE, mFile, 0);
+		if (map == MAP_FAILED)
+			throw std::runtime_error("Failed to map capture file");
+
+		mMap = static_cast<const byte *>(map);
+
+		PcapHeader header;
+		std::memcpy(&header, mMap, sizeof(header));
+		if (header.magic != PcapMagic || header.network != PcapLinkTypeUser0)
+			throw std::runtime_error("Unsupported capture file format");
+
+		mOffset = sizeof(header);
+	} catch (...) {
+		if (mMap)
+			munmap(const_cast<byte *>(mMap), mMapSize);
+		::close(mFile);
+		throw;
+	}
+}
+
+CaptureReader::~CaptureReader() {
+	munmap(const_cast<byte *>(mMap), mMapSize);
+	::close(mFile);
+}
+
+std::optional<CaptureReader::Record> CaptureReader::next() {
+	if (mOffset + sizeof(PcapRecordHeader) > mMapSize)
+		return std::nullopt;
+
+	PcapRecordHeader record;
+	std::memcpy(&record, mMap + mOffset, sizeof(record));
+
+	// A zeroed record marks the unused tail of a capture which was not closed properly
+	if (record.inclLen < sizeof(PseudoHeader) ||
+	    mOffset + sizeof(record) + record.inclLen > mMapSize)
+		return std::nullopt;
+
+	const byte *p = mMap + mOffset + sizeof(record);
+	mOffset += sizeof(record) + record.inclLen;
+
+	PseudoHeader pseudo;
+	std::memcpy(&pseudo, p, sizeof(pseudo));
+	const size_t idLength = std::min(size_t(ntohs(pseudo.idLength)),
+	                                 size_t(record.inclLen) - sizeof(pseudo));
+	p += sizeof(pseudo);
+
+	Record result;
+	result.timestamp = std::chrono::seconds(record.tsSec) +
+	                   std::chrono::microseconds(record.tsUsec);
+	result.direction = Capture::Direction(pseudo.direction);
+	result.stream = Capture::Stream(pseudo.stream);
+	result.id.assign(reinterpret_cast<const char *>(p), idLength);
+	result.data = p + idLength;
+	result.size = record.inclLen - sizeof(pseudo) - idLength;
+	result.truncated = record.inclLen < record.origLen;
+	return result;
+}
+
+} // namespace chubby
@@ -0,0 +1,86 @@
+/**
+ * Copyright (c) 2020 by Paul-Louis Ageneau
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHUBBY_CAPTURE_H
+#define CHUBBY_CAPTURE_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+
+namespace chubby {
+
+using std::byte;
+using std::string;
+
+// Records packets to a memory-mapped pcap file with link type LINKTYPE_USER0.
+// Each packet is prefixed with a pseudo-header: direction (1 byte), stream (1 byte),
+// session id length (2 bytes, network order), then the session id itself. Outbound packets
+// are recorded once on local ingress, before fan-out, so their session id is empty.
+class Capture {
+public:
+	enum class Direction : uint8_t { Inbound = 0, Outbound = 1 };
+	enum class Stream : uint8_t { Data = 0, Media = 1 };
+
+	Capture(const string &filename);
+	~Capture();
+
+	void write(Direction direction, Stream stream, const string &id, const byte *data,
+	           size_t size);
+
+private:
+	void reserve(size_t size);
+
+	int mFile = -1;
+	byte *mMap = nullptr;
+	size_t mMapSize = 0;
+	size_t mOffset = 0;
+	bool mFailed = false;
+
+	std::mutex mMutex;
+};
+
+class CaptureReader {
+public:
+	struct Record {
+		std::chrono::microseconds timestamp;
+		Capture::Direction direction;
+		Capture::Stream stream;
+		string id;
+		const byte *data;
+		size_t size;
+		bool truncated; // Cut to the snap length
+	};
+
+	CaptureReader(const string &filename);
+	~CaptureReader();
+
+	std::optional<Record> next();
+
+private:
+	int mFile = -1;
+	const byte *mMap = nullptr;
+	size_t mMapSize = 0;
+	size_t mOffset = 0;
+};
+
+} // namespace chubby
+
+#endif
@@ -15,23 +15,35 @@
  * License along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "capture.hpp"
+#include "ring.hpp"
 #include "signaling.hpp"
 #include "session.hpp"
 
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
 #include <chrono>
 #include <cstddef>
 #include <exception>
 #include <iostream>
 #include <list>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
 #include <thread>
+#include <vector>
 
 #include <netdb.h>
+#include <sched.h>
+#include <signal.h>
 #include <string.h>
+#include <sys/prctl.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 using namespace chubby;
@@ -41,16 +53,91 @@ using std::string;
 
 std::list<Session> sessions;
 
+struct Options {
+	string url = "ws://localhost:8000";
+	string dataName = "8001:localhost:8002";
+	string mediaName = "8003:localhost:8004";
+	string captureName;
+	unsigned workers = 1;
+	Session::Aggregation aggregation;
+	std::list<string> ids;
+};
+
+enum RingType : uint8_t { RingData = 0, RingMedia = 1 };
+
+// Receive buffer for local datagrams, which are fanned out across workers as is
+const size_t BufferSize = 4096;
+static_assert(BufferSize <= Ring::MaxSize, "Local datagrams must fit in ring slots");
+
+// Sanity bound only, every fanned out packet costs an eventfd write per worker
+const unsigned long MaxWorkers = 256;
+
+volatile sig_atomic_t stopping = 0;
+
+void onStopSignal(int) { stopping = 1; }
+
+// Handles SIGINT and SIGTERM with a flag. They are blocked in the calling thread, so in all
+// threads created afterwards, and only delivered while the select loop waits. The handler is
+// reset after the first signal, so a second one force-quits if stopping hangs.
+sigset_t handleStopSignals() {
+	struct sigaction sa = {};
+	sa.sa_handler = onStopSignal;
+	sa.sa_flags = SA_RESETHAND;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGINT, &sa, nullptr) == -1 || sigaction(SIGTERM, &sa, nullptr) == -1)
+		throw std::runtime_error("Failed to install signal handler");
+
+	sigset_t signals, previous;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, &previous);
+	return previous;
+}
+
 void showUsage(const string &name) {
 	std::cerr << "Usage: " << name << " <options> LOCAL [REMOTE1, REMOTE2,...]" << std::endl
 	          << "Options:" << std::endl
 	          << "\t-h, --help\t\tShow this help message" << std::endl
 	          << "\t-s, --sig URL\t\tSpecify the signaling server URL" << std::endl
 	          << "\t-d, --data ADDRESS\tSpecify the data UDP socket address" << std::endl
-	          << "\t-m, --media ADDRESS\tSpecify the media UDP socket address" << std::endl;
+	          << "\t-m, --media ADDRESS\tSpecify the media UDP socket address" << std::endl
+	          << "\t-c, --capture FILE\tCapture traffic to a pcap file" << std::endl
+	          << "\t-w, --workers COUNT\tSpread sessions over COUNT worker processes" << std::endl
+	          << "\t-a, --aggregate\t\tAggregate small datagrams on opened DataChannels"
+	          << std::endl
+	          << "\t--aggregate-size BYTES\tSpecify the max aggregated message size, larger"
+	          << std::endl
+	          << "\t\t\t\tdatagrams are sent alone (default: 16384)" << std::endl
+	          << "\t--aggregate-delay MS\tSpecify the aggregation flush delay" << std::endl;
+}
+
+// Parses a non-negative integer option argument, returns false if it is invalid
+bool parseNumber(const string &str, unsigned long &value) {
+	if (str.empty() || !std::isdigit(static_cast<unsigned char>(str.front())))
+		return false;
+
+	try {
+		size_t pos = 0;
+		value = std::stoul(str, &pos);
+		return pos == str.size();
+	} catch (const std::logic_error &) {
+		return false;
+	}
+}
+
+// Number of CPUs the process may run on, honoring affinity and cpuset restrictions
+unsigned long availableCpus() {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		return std::max(CPU_COUNT(&set), 1);
+
+	return std::max(std::thread::hardware_concurrency(), 1u);
 }
 
-int udpSocket(const string &name, struct sockaddr_storage &addr, socklen_t &addrlen) {
+int udpSocket(const string &name, struct sockaddr_storage &addr, socklen_t &addrlen,
+              bool reusePort = false) {
 	string local, host, service;
 	size_t p1 = name.find_first_of(':');
 	local = name.substr(0, p1);
@@ -96,6 +183,11 @@ int udpSocket(const string &name, struct sockaddr_storage &addr, socklen_t &addr
 		if (sock == -1)
 			throw std::runtime_error("Failed to create socket");
 
+		const int enabled = 1;
+		if (reusePort &&
+		    setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enabled, sizeof(enabled)) == -1)
+			throw std::runtime_error("Failed to set SO_REUSEPORT on socket");
+
 		if (bind(sock, reinterpret_cast<struct sockaddr *>(res->ai_addr), res->ai_addrlen) == -1)
 			throw std::runtime_error("Failed to bind socket");
 	} catch (...) {
@@ -107,13 +199,267 @@ int udpSocket(const string &name, struct sockaddr_storage &addr, socklen_t &addr
 	return sock;
 }
 
+int worker(Options options, unsigned index, Ring *ring) {
+	const unsigned count = ring ? options.workers : 1;
+	const sigset_t waitMask = handleStopSignals();
+
+	struct sockaddr_storage dataAddr;
+	socklen_t dataAddrLen = sizeof(dataAddr);
+	int dataSock = udpSocket(options.dataName, dataAddr, dataAddrLen, count > 1);
+
+	auto dataFunc = [dataSock, dataAddr, dataAddrLen](const byte *data, size_t size) {
+		int ret = sendto(dataSock, data, size, 0,
+		                 reinterpret_cast<const struct sockaddr *>(&dataAddr), dataAddrLen);
+		if (ret < 0)
+			throw std::runtime_error("send failed");
+	};
+
+	struct sockaddr_storage mediaAddr;
+	socklen_t mediaAddrLen = sizeof(dataAddr);
+	int mediaSock = udpSocket(options.mediaName, mediaAddr, mediaAddrLen, count > 1);
+
+	auto mediaFunc = [mediaSock, mediaAddr, mediaAddrLen](const byte *data, size_t size) {
+		int ret = sendto(mediaSock, data, size, 0,
+		                 reinterpret_cast<const struct sockaddr *>(&mediaAddr), mediaAddrLen);
+		if (ret < 0)
+			throw std::runtime_error("send failed");
+	};
+
+	std::shared_ptr<Capture> capture;
+	if (!options.captureName.empty())
+		capture = std::make_shared<Capture>(count > 1 ? options.captureName + "." +
+		                                                    std::to_string(index)
+		                                              : options.captureName);
+
+	std::list<string> &ids = options.ids;
+	string localId = std::move(ids.front());
+	ids.pop_front();
+
+	std::shared_ptr<Signaling> signaling;
+	signaling = std::make_shared<Signaling>([&](Message msg) {
+		sessions.emplace_back(signaling, msg.id, dataFunc, mediaFunc, capture, options.aggregation)
+		    .processSignaling(msg);
+	});
+
+	// Every worker connects with the same id, then only handles the peers it owns
+	signaling->partition(index, count);
+
+	string &url = options.url;
+	if (url.empty() || url.back() != '/')
+		url.push_back('/');
+
+	signaling->connect(url + localId);
+
+	while (!ids.empty()) {
+		if (Signaling::Owner(ids.front(), count) == index)
+			sessions
+			    .emplace_back(signaling, ids.front(), dataFunc, mediaFunc, capture,
+			                  options.aggregation)
+			    .open();
+
+		ids.pop_front();
+	}
+
+	auto ringFunc = [](uint8_t type, const byte *data, size_t size) {
+		for (auto &s : sessions) {
+			if (type == RingMedia)
+				s.sendMedia(data, size);
+			else
+				s.sendData(data, size);
+		}
+	};
+
+	while (!stopping) {
+		fd_set readfds;
+		FD_ZERO(&readfds);
+		FD_SET(dataSock, &readfds);
+		FD_SET(mediaSock, &readfds);
+		int n = std::max(dataSock, mediaSock) + 1;
+		if (ring) {
+			FD_SET(ring->fd(), &readfds);
+			n = std::max(n, ring->fd() + 1);
+		}
+
+		// Wake up for the earliest aggregation flush deadline
+		std::optional<Session::clock::time_point> flushTime;
+		for (const auto &s : sessions)
+			if (auto t = s.flushTime(); t && (!flushTime || *t < *flushTime))
+				flushTime = t;
+
+		struct timespec ts = {};
+		if (flushTime) {
+			auto timeout = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			    *flushTime - Session::clock::now());
+			if (timeout.count() > 0) {
+				ts.tv_sec = timeout.count() / 1000000000;
+				ts.tv_nsec = timeout.count() % 1000000000;
+			}
+		}
+
+		if (pselect(n, &readfds, NULL, NULL, flushTime ? &ts : NULL, &waitMask) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			throw std::runtime_error("select failed");
+		}
+
+		const size_t size = BufferSize;
+		char buffer[size];
+
+		if (FD_ISSET(dataSock, &readfds)) {
+			struct sockaddr_storage addr;
+			socklen_t addrlen = sizeof(addr);
+			int ret = recvfrom(dataSock, buffer, size, MSG_DONTWAIT,
+			                   reinterpret_cast<struct sockaddr *>(&addr), &addrlen);
+			if (ret == 0) {
+				break;
+			} else if (ret < 0) {
+				if (ret != EAGAIN && ret != EWOULDBLOCK)
+					throw std::runtime_error("recv failed");
+			} else {
+				// Publish first so other workers encrypt in parallel with local sessions
+				if (ring)
+					ring->publish(RingData, reinterpret_cast<byte *>(buffer), ret);
+
+				// Local ingress is captured once for all sessions, with an empty id
+				if (capture)
+					capture->write(Capture::Direction::Outbound, Capture::Stream::Data, "",
+					               reinterpret_cast<byte *>(buffer), ret);
+
+				for (auto &s : sessions)
+					s.sendData(reinterpret_cast<byte *>(buffer), ret);
+			}
+		}
+
+		if (FD_ISSET(mediaSock, &readfds)) {
+			struct sockaddr_storage addr;
+			socklen_t addrlen = sizeof(addr);
+			int ret = recvfrom(mediaSock, buffer, size, MSG_DONTWAIT,
+			                   reinterpret_cast<struct sockaddr *>(&addr), &addrlen);
+			if (ret == 0) {
+				break;
+			} else if (ret < 0) {
+				if (ret != EAGAIN && ret != EWOULDBLOCK)
+					throw std::runtime_error("recv failed");
+			} else {
+				if (ring)
+					ring->publish(RingMedia, reinterpret_cast<byte *>(buffer), ret);
+
+				if (capture)
+					capture->write(Capture::Direction::Outbound, Capture::Stream::Media, "",
+					               reinterpret_cast<byte *>(buffer), ret);
+
+				for (auto &s : sessions)
+					s.sendMedia(reinterpret_cast<byte *>(buffer), ret);
+			}
+		}
+
+		if (ring && FD_ISSET(ring->fd(), &readfds))
+			ring->poll(ringFunc);
+
+		const auto now = Session::clock::now();
+		for (auto &s : sessions)
+			if (auto t = s.flushTime(); t && *t <= now)
+				s.flush();
+	}
+
+	// Destroy sessions and capture on the way out, so the capture file gets trimmed
+	std::cout << "Stopping" << std::endl;
+	pthread_sigmask(SIG_SETMASK, &waitMask, nullptr);
+	sessions.clear();
+	return 0;
+}
+
+void onChildSignal(int) {}
+
+// Forks the workers, which return from this function in the child process
+int supervise(const Options &options) {
+	Ring ring(options.workers);
+
+	// Keep stop signals and SIGCHLD blocked except while suspended, so none is missed
+	const sigset_t previousMask = handleStopSignals();
+	struct sigaction sa = {};
+	sa.sa_handler = onChildSignal;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGCHLD, &sa, nullptr) == -1)
+		throw std::runtime_error("Failed to install signal handler");
+
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGCHLD);
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+	sigset_t waitMask = previousMask;
+	sigdelset(&waitMask, SIGINT);
+	sigdelset(&waitMask, SIGTERM);
+	sigdelset(&waitMask, SIGCHLD);
+
+	const pid_t supervisor = getpid();
+	std::vector<pid_t> pids;
+	auto stopWorkers = [&pids]() {
+		for (pid_t p : pids)
+			kill(p, SIGTERM);
+
+		while (wait(nullptr) > 0 || errno == EINTR) {
+		}
+	};
+
+	for (unsigned i = 0; i < options.workers; ++i) {
+		pid_t pid = fork();
+		if (pid == -1) {
+			stopWorkers();
+			throw std::runtime_error("fork failed");
+		}
+
+		if (pid == 0) {
+			// Workers must not outlive the supervisor, even if it is killed with SIGKILL
+			signal(SIGCHLD, SIG_DFL);
+			pthread_sigmask(SIG_SETMASK, &previousMask, nullptr);
+			if (prctl(PR_SET_PDEATHSIG, SIGTERM) == -1 || getppid() != supervisor)
+				return 2;
+
+			ring.attach(i);
+			try {
+				return worker(options, i, &ring);
+			} catch (const std::exception &e) {
+				std::cerr << "Worker " << i << ": " << e.what() << std::endl;
+				return 2;
+			}
+		}
+
+		std::cout << "Started worker " << i << " with pid " << pid << std::endl;
+		pids.push_back(pid);
+	}
+
+	// Stop everything as soon as a worker exits or the supervisor is asked to stop
+	int status = 0;
+	while (true) {
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+		if (pid > 0)
+			break;
+
+		if (pid == -1 && errno != EINTR)
+			throw std::runtime_error("wait failed");
+
+		if (stopping) {
+			std::cout << "Stopping workers" << std::endl;
+			status = 0;
+			break;
+		}
+
+		sigsuspend(&waitMask);
+	}
+
+	// Let a second stop signal kill the supervisor, workers then get their death signal
+	pthread_sigmask(SIG_SETMASK, &previousMask, nullptr);
+	stopWorkers();
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 2;
+}
+
 int main(int argc, char *argv[]) {
-	string url = "ws://localhost:8000";
-	string dataName = "8001:localhost:8002";
-	string mediaName = "8003:localhost:8004";
+	Options options;
 
 	try {
-		std::list<string> ids;
 		for (int i = 1; i < argc; ++i) {
 			const string arg = argv[i];
 			if (arg == "-h" || arg == "--help") {
@@ -121,119 +467,82 @@ int main(int argc, char *argv[]) {
 				return 0;
 			} else if (arg == "-s" || arg == "--signaling") {
 				if (i + 1 < argc) {
-					url = argv[++i];
+					options.url = argv[++i];
 				} else {
 					std::cerr << "--signaling option requires URL as argument." << std::endl;
 					return 1;
 				}
 			} else if (arg == "-d" || arg == "--data") {
 				if (i + 1 < argc) {
-					dataName = argv[++i];
+					options.dataName = argv[++i];
 				} else {
 					std::cerr << "--data option requires socket address as argument." << std::endl;
 					return 1;
 				}
 			} else if (arg == "-m" || arg == "--media") {
 				if (i + 1 < argc) {
-					mediaName = argv[++i];
+					options.mediaName = argv[++i];
 				} else {
 					std::cerr << "--media option requires socket address as argument." << std::endl;
 					return 1;
 				}
+			} else if (arg == "-c" || arg == "--capture") {
+				if (i + 1 < argc) {
+					options.captureName = argv[++i];
+				} else {
+					std::cerr << "--capture option requires file name as argument." << std::endl;
+					return 1;
+				}
+			} else if (arg == "-w" || arg == "--workers") {
+				unsigned long workers;
+				if (i + 1 < argc && parseNumber(argv[++i], workers) && workers >= 1 &&
+				    workers <= MaxWorkers) {
+					// Workers beyond the available cores only add wakeups to the fan-out
+					const unsigned long cpus = availableCpus();
+					if (workers > cpus)
+						std::cerr << "Warning: " << workers << " workers for " << cpus
+						          << " available CPUs" << std::endl;
+
+					options.workers = unsigned(workers);
+				} else {
+					std::cerr << "--workers option requires count between 1 and " << MaxWorkers
+					          << " as argument." << std::endl;
+					return 1;
+				}
+			} else if (arg == "-a" || arg == "--aggregate") {
+				options.aggregation.enabled = true;
+			} else if (arg == "--aggregate-size") {
+				unsigned long size;
+				if (i + 1 < argc && parseNumber(argv[++i], size) && size >= 3) {
+					options.aggregation.maxSize = size;
+				} else {
+					std::cerr << "--aggregate-size option requires size of at least 3 as argument."
+					          << std::endl;
+					return 1;
+				}
+			} else if (arg == "--aggregate-delay") {
+				unsigned long delay;
+				if (i + 1 < argc && parseNumber(argv[++i], delay)) {
+					options.aggregation.flushDelay = std::chrono::milliseconds(delay);
+				} else {
+					std::cerr << "--aggregate-delay option requires delay as argument."
+					          << std::endl;
+					return 1;
+				}
 			} else {
-				ids.push_back(argv[i]);
+				options.ids.push_back(argv[i]);
 			}
 		}
 
-		if (ids.empty()) {
+		if (options.ids.empty()) {
 			showUsage(argv[0]);
 			return 1;
 		}
 
-		struct sockaddr_storage dataAddr;
-		socklen_t dataAddrLen = sizeof(dataAddr);
-		int dataSock = udpSocket(dataName, dataAddr, dataAddrLen);
-
-		auto dataFunc = [dataSock, dataAddr, dataAddrLen](const byte *data, size_t size) {
-			int ret = sendto(dataSock, data, size, 0,
-			                 reinterpret_cast<const struct sockaddr *>(&dataAddr), dataAddrLen);
-			if (ret < 0)
-				throw std::runtime_error("send failed");
-		};
-
-		struct sockaddr_storage mediaAddr;
-		socklen_t mediaAddrLen = sizeof(dataAddr);
-		int mediaSock = udpSocket(mediaName, mediaAddr, mediaAddrLen);
-
-		auto mediaFunc = [mediaSock, mediaAddr, mediaAddrLen](const byte *data, size_t size) {
-			int ret = sendto(mediaSock, data, size, 0,
-			                 reinterpret_cast<const struct sockaddr *>(&mediaAddr), mediaAddrLen);
-			if (ret < 0)
-				throw std::runtime_error("send failed");
-		};
-
-		string localId = std::move(ids.front());
-		ids.pop_front();
-
-		std::shared_ptr<Signaling> signaling;
-		signaling = std::make_shared<Signaling>([&](Message msg) {
-			sessions.emplace_back(signaling, msg.id, dataFunc, mediaFunc).processSignaling(msg);
-		});
-
-		if (url.empty() || url.back() != '/')
-			url.push_back('/');
-
-		signaling->connect(url + localId);
-
-		while (!ids.empty()) {
-			sessions.emplace_back(signaling, ids.front(), dataFunc, mediaFunc).open();
-			ids.pop_front();
-		}
-
-		while (true) {
-			fd_set readfds;
-			FD_ZERO(&readfds);
-			FD_SET(dataSock, &readfds);
-			FD_SET(mediaSock, &readfds);
-			int n = std::max(dataSock, mediaSock) + 1;
-			if (select(n, &readfds, NULL, NULL, NULL) == -1)
-				throw std::runtime_error("select failed");
-
-			const size_t size = 4096;
-			char buffer[size];
-
-			if (FD_ISSET(dataSock, &readfds)) {
-				struct sockaddr_storage addr;
-				socklen_t addrlen = sizeof(addr);
-				int ret = recvfrom(dataSock, buffer, size, MSG_DONTWAIT,
-				                   reinterpret_cast<struct sockaddr *>(&addr), &addrlen);
-				if (ret == 0) {
-					break;
-				} else if (ret < 0) {
-					if (ret != EAGAIN && ret != EWOULDBLOCK)
-						throw std::runtime_error("recv failed");
-				} else {
-					for (auto &s : sessions)
-						s.sendData(reinterpret_cast<byte *>(buffer), ret);
-				}
-			}
-
-			if (FD_ISSET(mediaSock, &readfds)) {
-				struct sockaddr_storage addr;
-				socklen_t addrlen = sizeof(addr);
-				int ret = recvfrom(mediaSock, buffer, size, MSG_DONTWAIT,
-				                   reinterpret_cast<struct sockaddr *>(&addr), &addrlen);
-				if (ret == 0) {
-					break;
-				} else if (ret < 0) {
-					if (ret != EAGAIN && ret != EWOULDBLOCK)
-						throw std::runtime_error("recv failed");
-				} else {
-					for (auto &s : sessions)
-						s.sendMedia(reinterpret_cast<byte *>(buffer), ret);
-				}
-			}
-		}
+		if (options.workers > 1)
+			return supervise(options);
+		else
+			return worker(std::move(options), 0, nullptr);
 
 	} catch (const std::exception &e) {
 		std::cerr << e.what() << std::endl;
@@ -0,0 +1,184 @@
+/**
+ * Copyright (c) 2020 by Paul-Louis Ageneau
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "capture.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+using namespace chubby;
+using std::byte;
+using std::string;
+
+void showUsage(const string &name) {
+	std::cerr << "Usage: " << name << " <options> FILE" << std::endl
+	          << "Options:" << std::endl
+	          << "\t-h, --help\t\tShow this help message" << std::endl
+	          << "\t-d, --data ADDRESS\tSpecify the data UDP target address" << std::endl
+	          << "\t-m, --media ADDRESS\tSpecify the media UDP target address" << std::endl
+	          << "\t-s, --scale FACTOR\tScale timing by FACTOR, 0 for no delay (default: 1)"
+	          << std::endl;
+}
+
+int udpTarget(const string &name, struct sockaddr_storage &addr, socklen_t &addrlen) {
+	string host, service;
+	size_t p = name.find_last_of(':');
+	if (p != string::npos) {
+		host = name.substr(0, p);
+		service = name.substr(p + 1);
+	} else {
+		host = "localhost";
+		service = name;
+	}
+
+	struct addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+	hints.ai_flags = AI_ADDRCONFIG;
+
+	struct addrinfo *res = nullptr;
+	if (getaddrinfo(host.c_str(), service.c_str(), &hints, &res) != 0 || !res)
+		throw std::runtime_error("Failed to resolve target address");
+
+	std::memcpy(&addr, res->ai_addr, res->ai_addrlen);
+	addrlen = res->ai_addrlen;
+
+	int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	freeaddrinfo(res);
+	if (sock == -1)
+		throw std::runtime_error("Failed to create socket");
+
+	return sock;
+}
+
+int main(int argc, char *argv[]) {
+	string dataName = "localhost:8001";
+	string mediaName = "localhost:8003";
+	double scale = 1.0;
+
+	try {
+		string filename;
+		for (int i = 1; i < argc; ++i) {
+			const string arg = argv[i];
+			if (arg == "-h" || arg == "--help") {
+				showUsage(argv[0]);
+				return 0;
+			} else if (arg == "-d" || arg == "--data") {
+				if (i + 1 < argc) {
+					dataName = argv[++i];
+				} else {
+					std::cerr << "--data option requires socket address as argument." << std::endl;
+					return 1;
+				}
+			} else if (arg == "-m" || arg == "--media") {
+				if (i + 1 < argc) {
+					mediaName = argv[++i];
+				} else {
+					std::cerr << "--media option requires socket address as argument." << std::endl;
+					return 1;
+				}
+			} else if (arg == "-s" || arg == "--scale") {
+				if (i + 1 < argc) {
+					scale = std::stod(argv[++i]);
+				} else {
+					std::cerr << "--scale option requires factor as argument." << std::endl;
+					return 1;
+				}
+			} else {
+				filename = arg;
+			}
+		}
+
+		if (filename.empty() || scale < 0.) {
+			showUsage(argv[0]);
+			return 1;
+		}
+
+		struct sockaddr_storage dataAddr;
+		socklen_t dataAddrLen = sizeof(dataAddr);
+		int dataSock = udpTarget(dataName, dataAddr, dataAddrLen);
+
+		struct sockaddr_storage mediaAddr;
+		socklen_t mediaAddrLen = sizeof(mediaAddr);
+		int mediaSock = udpTarget(mediaName, mediaAddr, mediaAddrLen);
+
+		CaptureReader reader(filename);
+
+		// Outbound packets are what chubby received on its local sockets
+		using clock = std::chrono::steady_clock;
+		std::optional<std::chrono::microseconds> first;
+		clock::time_point start;
+		unsigned long count = 0;
+		unsigned long skipped = 0;
+		while (auto record = reader.next()) {
+			if (record->direction != Capture::Direction::Outbound)
+				continue;
+
+			if (record->truncated) {
+				++skipped; // Replaying a partial packet would be misleading
+				continue;
+			}
+
+			if (!first) {
+				first = record->timestamp;
+				start = clock::now();
+			} else if (scale > 0.) {
+				const auto offset = std::chrono::duration<double, std::micro>(
+				    (record->timestamp - *first).count() * scale);
+				std::this_thread::sleep_until(
+				    start + std::chrono::duration_cast<clock::duration>(offset));
+			}
+
+			int ret;
+			if (record->stream == Capture::Stream::Media)
+				ret = sendto(mediaSock, record->data, record->size, 0,
+				             reinterpret_cast<const struct sockaddr *>(&mediaAddr), mediaAddrLen);
+			else
+				ret = sendto(dataSock, record->data, record->size, 0,
+				             reinterpret_cast<const struct sockaddr *>(&dataAddr), dataAddrLen);
+
+			if (ret < 0)
+				throw std::runtime_error("send failed");
+
+			++count;
+		}
+
+		std::cout << "Replayed " << count << " packets, skipped " << skipped << " truncated packets"
+		          << std::endl;
+
+		close(dataSock);
+		close(mediaSock);
+
+	} catch (const std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return 2;
+	}
+
+	return 0;
+}
@@ -0,0 +1,186 @@
+/**
+ * Copyright (c) 2020 by Paul-Louis Ageneau
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <stdexcept>
+
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace chubby {
+
+namespace {
+
+// Sequence marker for a slot being written
+const uint64_t Writing = ~uint64_t(0);
+
+} // namespace
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "Shared memory ring requires lock-free 64-bit atomics");
+
+// Slots are stamped with their sequence number plus one once published, readers check the
+// stamp again after copying to detect a concurrent overwrite.
+struct Ring::Slot {
+	std::atomic<uint64_t> seq;
+	uint32_t origin;
+	uint16_t size;
+	uint8_t type;
+	byte data[MaxSize];
+};
+
+struct Ring::Shared {
+	std::atomic<uint64_t> head;
+	Slot slots[SlotCount];
+};
+
+Ring::Ring(unsigned count) {
+	mSharedSize = sizeof(Shared);
+	void *map = mmap(nullptr, mSharedSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1,
+	                 0);
+	if (map == MAP_FAILED)
+		throw std::runtime_error("Failed to map shared memory");
+
+	mShared = static_cast<Shared *>(map);
+	new (&mShared->head) std::atomic<uint64_t>(0);
+	for (Slot &s : mShared->slots)
+		new (&s.seq) std::atomic<uint64_t>(0);
+
+	for (unsigned i = 0; i < count; ++i) {
+		int fd = eventfd(0, EFD_NONBLOCK);
+		if (fd == -1) {
+			for (int e : mEvents)
+				close(e);
+			munmap(mShared, mSharedSize);
+			throw std::runtime_error("Failed to create eventfd");
+		}
+		mEvents.push_back(fd);
+	}
+}
+
+Ring::~Ring() {
+	for (int e : mEvents)
+		close(e);
+
+	munmap(mShared, mSharedSize);
+}
+
+void Ring::attach(unsigned index) {
+	if (index >= mEvents.size())
+		throw std::invalid_argument("Invalid ring index");
+
+	mIndex = index;
+	mCursor = mShared->head.load(std::memory_order_acquire);
+}
+
+int Ring::fd() const { return mEvents[mIndex]; }
+
+void Ring::publish(uint8_t type, const byte *data, size_t size) {
+	if (size > MaxSize)
+		throw std::invalid_argument("Packet too large for ring");
+
+	const uint64_t seq = mShared->head.fetch_add(1, std::memory_order_acq_rel);
+	Slot &s = slot(seq);
+
+	s.seq.store(Writing, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	s.origin = mIndex;
+	s.type = type;
+	s.size = uint16_t(size);
+	std::memcpy(s.data, data, size);
+
+	s.seq.store(seq + 1, std::memory_order_release);
+
+	const uint64_t one = 1;
+	for (unsigned i = 0; i < mEvents.size(); ++i)
+		if (i != mIndex && write(mEvents[i], &one, sizeof(one)) != sizeof(one)) {
+			// Ignore, the counter can only be saturated if the worker is already notified
+		}
+}
+
+void Ring::poll(const Callback &callback) {
+	uint64_t value;
+	if (read(mEvents[mIndex], &value, sizeof(value)) != sizeof(value)) {
+		// Ignore, the ring is read anyway
+	}
+
+	byte buffer[MaxSize];
+	const uint64_t head = mShared->head.load(std::memory_order_acquire);
+	if (head - mCursor > SlotCount) {
+		// Lagging behind, drop what was overwritten
+		overrun(head - SlotCount - mCursor);
+		mCursor = head - SlotCount;
+	}
+
+	while (mCursor < head) {
+		Slot &s = slot(mCursor);
+		const uint64_t stamp = s.seq.load(std::memory_order_acquire);
+		if (stamp == Writing || stamp < mCursor + 1)
+			break; // Not published yet, the writer will notify once done
+
+		if (stamp > mCursor + 1) {
+			++mCursor; // Overwritten
+			overrun(1);
+			continue;
+		}
+
+		const uint32_t origin = s.origin;
+		const uint8_t type = s.type;
+		const size_t size = std::min(size_t(s.size), MaxSize);
+		std::memcpy(buffer, s.data, size);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (s.seq.load(std::memory_order_relaxed) != stamp) {
+			++mCursor; // Overwritten while reading
+			overrun(1);
+			continue;
+		}
+
+		++mCursor;
+		if (origin != mIndex)
+			callback(type, buffer, size);
+	}
+}
+
+uint64_t Ring::overruns() const { return mOverruns; }
+
+Ring::Slot &Ring::slot(uint64_t seq) { return mShared->slots[seq % SlotCount]; }
+
+void Ring::overrun(uint64_t count) {
+	mOverruns += count;
+	mUnreportedOverruns += count;
+
+	// Report at most once per second, an overrun usually comes with many more
+	const auto now = std::chrono::steady_clock::now();
+	if (now - mLastReport < std::chrono::seconds(1))
+		return;
+
+	std::cerr << "Worker " << mIndex << " lagging behind, " << mUnreportedOverruns
+	          << " packets dropped from the ring (" << mOverruns << " in total)" << std::endl;
+	mUnreportedOverruns = 0;
+	mLastReport = now;
+}
+
+} // namespace chubby
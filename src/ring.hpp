@@ -0,0 +1,75 @@
+/**
+ * Copyright (c) 2020 by Paul-Louis Ageneau
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public
+ * License along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHUBBY_RING_H
+#define CHUBBY_RING_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace chubby {
+
+using std::byte;
+
+// Broadcast ring in shared memory, used to fan out packets across worker processes.
+// It must be created before forking, then each worker calls attach() with its index.
+class Ring {
+public:
+	using Callback = std::function<void(uint8_t type, const byte *data, size_t size)>;
+
+	static constexpr size_t MaxSize = 4096;
+
+	// Each slot holds a full MaxSize packet, so the ring takes 16 MiB of shared memory and a
+	// worker busy encrypting may lag 4096 packets behind before it starts dropping.
+	static constexpr uint64_t SlotCount = 4096;
+
+	Ring(unsigned count);
+	~Ring();
+
+	void attach(unsigned index);
+	int fd() const;
+
+	void publish(uint8_t type, const byte *data, size_t size);
+	void poll(const Callback &callback);
+
+	uint64_t overruns() const;
+
+private:
+	struct Shared;
+	struct Slot;
+
+	Slot &slot(uint64_t seq);
+	void overrun(uint64_t count);
+
+	Shared *mShared = nullptr;
+	size_t mSharedSize = 0;
+	std::vector<int> mEvents;
+
+	unsigned mIndex = 0;
+	uint64_t mCursor = 0;
+
+	uint64_t mOverruns = 0;
+	uint64_t mUnreportedOverruns = 0;
+	std::chrono::steady_clock::time_point mLastReport;
+};
+
+} // namespace chubby
+
+#endif
@@ -18,6 +18,7 @@
 #include "session.hpp"
 #include "message.hpp"
 
+#include <algorithm>
 #include <functional>
 
 namespace chubby {
@@ -25,10 +26,18 @@ namespace chubby {
 using namespace std::placeholders;
 using std::shared_ptr;
 
+namespace {
+
+const string DataLabel = "data";
+const string AggregatedDataLabel = "data-aggregated";
+
+} // namespace
 
 Session::Session(shared_ptr<Signaling> signaling, string id, RecvCallback dataCallback,
-                 RecvCallback mediaCallback)
-    : mSignaling(std::move(signaling)), mId(std::move(id)), mDataCallback(std::move(dataCallback)) {
+                 RecvCallback mediaCallback, shared_ptr<Capture> capture, Aggregation aggregation)
+    : mSignaling(std::move(signaling)), mCapture(std::move(capture)), mId(std::move(id)),
+      mDataCallback(std::move(dataCallback)), mAggregation(std::move(aggregation)),
+      mPendingLimit(mAggregation.maxSize) {
 
 	rtc::InitLogger(rtc::LogLevel::Warning);
 	std::cout << "Creating session " << mId << std::endl;
@@ -43,7 +52,12 @@ Session::Session(shared_ptr<Signaling> signaling, string id, RecvCallback dataCa
 	mPeerConnection->onLocalCandidate(std::bind(&Session::onLocalCandidate, this, _1));
 	mPeerConnection->onDataChannel(std::bind(&Session::onDataChannel, this, _1));
 
-	mPeerConnection->onMedia([mediaCallback = std::move(mediaCallback)](const rtc::binary &bin) {
+	mPeerConnection->onMedia([this, mediaCallback =
+	                                    std::move(mediaCallback)](const rtc::binary &bin) {
+		if (mCapture)
+			mCapture->write(Capture::Direction::Inbound, Capture::Stream::Media, mId, bin.data(),
+			                bin.size());
+
 		mediaCallback(bin.data(), bin.size());
 	});
 }
@@ -51,7 +65,7 @@ Session::Session(shared_ptr<Signaling> signaling, string id, RecvCallback dataCa
 Session::~Session() { std::cout << "Destroying session " << mId << std::endl; }
 
 void Session::open() {
-	const string label = "data";
+	const string label = mAggregation.enabled ? AggregatedDataLabel : DataLabel;
 	std::cout << "Creating DataChannel \"" << label << "\"" << std::endl;
 
 	const string sdp = "m=audio 54609 UDP/TLS/RTP/SAVPF 109\r\n"
@@ -62,19 +76,63 @@ void Session::open() {
 	                   "a=sendrecv\r\n";
 	mPeerConnection->setLocalDescription(rtc::Description{sdp, rtc::Description::Type::Offer});
 
-	mDataChannel = mPeerConnection->createDataChannel(label);
+	auto dc = mPeerConnection->createDataChannel(label);
+
+	// The mode must be visible before the DataChannel is published to the select loop
+	mAggregated = mAggregation.enabled;
+	std::atomic_store(&mDataChannel, dc);
 
-	mDataChannel->onOpen(std::bind(&Session::onOpen, this));
-	mDataChannel->onClosed(std::bind(&Session::onClosed, this));
-	mDataChannel->onMessage(std::bind(&Session::onMessage, this, _1));
+	dc->onOpen(std::bind(&Session::onOpen, this));
+	dc->onClosed(std::bind(&Session::onClosed, this));
+	dc->onMessage(std::bind(&Session::onMessage, this, _1));
 }
 
 void Session::sendData(const byte *data, size_t size) {
-	if (mDataChannel)
-		mDataChannel->send(data, size);
+	auto dc = std::atomic_load(&mDataChannel);
+	if (!dc)
+		return;
+
+	if (!mAggregated) {
+		dc->send(data, size);
+		return;
+	}
+
+	const size_t limit = mPendingLimit;
+	if (!mPending.empty() && mPending.size() + 2 + size > limit)
+		flush();
+
+	if (size > 0xFFFF || 2 + size > dc->maxMessageSize()) {
+		std::cerr << "Datagram too large for the DataChannel, dropping" << std::endl;
+		return;
+	}
+
+	// A datagram over the aggregation limit is simply sent alone in a single frame
+	mPending.push_back(byte(size >> 8));
+	mPending.push_back(byte(size & 0xFF));
+	mPending.insert(mPending.end(), data, data + size);
+
+	if (mPending.size() >= limit)
+		flush();
+	else if (!mFlushTime)
+		mFlushTime = clock::now() + mAggregation.flushDelay;
+}
+
+void Session::sendMedia(const byte *data, size_t size) {
+	mPeerConnection->sendMedia(data, size);
 }
 
-void Session::sendMedia(const byte *data, size_t size) { mPeerConnection->sendMedia(data, size); }
+void Session::flush() {
+	mFlushTime.reset();
+	if (mPending.empty())
+		return;
+
+	if (auto dc = std::atomic_load(&mDataChannel))
+		dc->send(mPending.data(), mPending.size());
+
+	mPending.clear();
+}
+
+std::optional<Session::clock::time_point> Session::flushTime() const { return mFlushTime; }
 
 void Session::processSignaling(Message msg) {
 	std::cout << "Processing signaling message, type=\"" << msg.type << "\"" << std::endl;
@@ -106,13 +164,20 @@ void Session::onLocalCandidate(const rtc::Candidate &cand) {
 
 void Session::onDataChannel(std::shared_ptr<rtc::DataChannel> dc) {
 	std::cout << "Received DataChannel \"" << dc->label() << "\"" << std::endl;
-	mDataChannel = std::move(dc);
-	mDataChannel->onClosed(std::bind(&Session::onClosed, this));
-	mDataChannel->onMessage(std::bind(&Session::onMessage, this, _1));
+	mAggregated = dc->label() == AggregatedDataLabel;
+	dc->onClosed(std::bind(&Session::onClosed, this));
+	dc->onMessage(std::bind(&Session::onMessage, this, _1));
+	std::atomic_store(&mDataChannel, std::move(dc));
 	onOpen();
 }
 
-void Session::onOpen() { std::cout << "Open" << std::endl; }
+void Session::onOpen() {
+	std::cout << "Open" << std::endl;
+
+	// Aggregated messages should fit in what the remote side accepts
+	if (auto dc = std::atomic_load(&mDataChannel))
+		mPendingLimit = std::min(mAggregation.maxSize, dc->maxMessageSize());
+}
 
 void Session::onClosed() { std::cout << "Closed" << std::endl; }
 
@@ -120,8 +185,30 @@ void Session::onMessage(const std::variant<rtc::binary, rtc::string> &message) {
 	std::cout << "Message" << std::endl;
 	if (std::holds_alternative<rtc::binary>(message)) {
 		const auto &bin = std::get<rtc::binary>(message);
-		mDataCallback(bin.data(), bin.size());
+		if (!mAggregated) {
+			onData(bin.data(), bin.size());
+			return;
+		}
+
+		size_t i = 0;
+		while (i + 2 <= bin.size()) {
+			const size_t size = (size_t(bin[i]) << 8) | size_t(bin[i + 1]);
+			i += 2;
+			if (i + size > bin.size()) {
+				std::cerr << "Truncated aggregated message" << std::endl;
+				break;
+			}
+			onData(bin.data() + i, size);
+			i += size;
+		}
 	}
 }
 
+void Session::onData(const byte *data, size_t size) {
+	if (mCapture)
+		mCapture->write(Capture::Direction::Inbound, Capture::Stream::Data, mId, data, size);
+
+	mDataCallback(data, size);
+}
+
 } // namespace chubby
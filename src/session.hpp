@@ -18,11 +18,15 @@
 #ifndef CHUBBY_SESSION_H
 #define CHUBBY_SESSION_H
 
+#include "capture.hpp"
 #include "signaling.hpp"
 
 #include "rtc/rtc.hpp"
 
+#include <atomic>
+#include <chrono>
 #include <memory>
+#include <optional>
 
 namespace chubby {
 
@@ -31,8 +35,18 @@ using std::byte;
 class Session {
 public:
 	using RecvCallback = std::function<void(const byte *, size_t)>;
+	using clock = std::chrono::steady_clock;
+
+	// Packing of small datagrams into a single DataChannel message with 16-bit length prefixes,
+	// the mode is chosen by the side opening the DataChannel and advertised in its label.
+	struct Aggregation {
+		bool enabled = false;
+		size_t maxSize = 16384;
+		std::chrono::milliseconds flushDelay = std::chrono::milliseconds(5);
+	};
+
 	Session(std::shared_ptr<Signaling> signaling, std::string id, RecvCallback dataCallback,
-	        RecvCallback mediaCallback);
+	        RecvCallback mediaCallback, std::shared_ptr<Capture> capture, Aggregation aggregation);
 	~Session();
 
 	void open();
@@ -40,6 +54,9 @@ public:
 	void sendMedia(const byte *data, size_t size);
 	void processSignaling(Message msg);
 
+	void flush();
+	std::optional<clock::time_point> flushTime() const;
+
 private:
 	void onStateChange(rtc::PeerConnection::State state);
 	void onLocalDescription(const rtc::Description &desc);
@@ -48,15 +65,23 @@ private:
 	void onOpen();
 	void onClosed();
 	void onMessage(const std::variant<rtc::binary, rtc::string> &message);
+	void onData(const byte *data, size_t size);
 
 	std::shared_ptr<Signaling> mSignaling;
 	std::shared_ptr<rtc::PeerConnection> mPeerConnection;
 	std::shared_ptr<rtc::DataChannel> mDataChannel;
+	std::shared_ptr<Capture> mCapture;
 
 	std::string mId;
 	Signaling::Token mToken;
 
 	RecvCallback mDataCallback;
+
+	Aggregation mAggregation;
+	std::atomic<bool> mAggregated = false;
+	std::atomic<size_t> mPendingLimit;
+	rtc::binary mPending;
+	std::optional<clock::time_point> mFlushTime;
 };
 
 } // namespace chubby
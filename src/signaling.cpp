@@ -17,6 +17,8 @@
 
 #include "signaling.hpp"
 
+#include <cstdint>
+#include <stdexcept>
 #include <variant>
 
 namespace chubby {
@@ -61,6 +63,38 @@ Signaling::Token Signaling::recv(string id, Callback recvCallback) {
 	return shared;
 }
 
+void Signaling::partition(unsigned index, unsigned count) {
+	if (count == 0 || index >= count)
+		throw std::invalid_argument("Invalid signaling partition");
+
+	std::lock_guard lock(mMutex);
+	mPartitionIndex = index;
+	mPartitionCount = count;
+}
+
+unsigned Signaling::Owner(const string &id, unsigned count) {
+	// Rendezvous hashing, so only the peers of a removed partition would move
+	uint64_t hash = 0xcbf29ce484222325; // FNV-1a
+	for (char c : id) {
+		hash ^= uint8_t(c);
+		hash *= 0x100000001b3;
+	}
+
+	unsigned owner = 0;
+	uint64_t best = 0;
+	for (unsigned i = 0; i < count; ++i) {
+		uint64_t h = hash ^ (uint64_t(i + 1) * 0x9e3779b97f4a7c15); // splitmix64
+		h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9;
+		h = (h ^ (h >> 27)) * 0x94d049bb133111eb;
+		h ^= h >> 31;
+		if (i == 0 || h > best) {
+			best = h;
+			owner = i;
+		}
+	}
+	return owner;
+}
+
 void Signaling::onOpen() {
 	std::cout << "Signaling open" << std::endl;
 	flush();
@@ -105,6 +139,9 @@ void Signaling::dispatch(Message message) {
 	std::shared_ptr<Callback> locked;
 	{
 		std::lock_guard lock(mMutex);
+		if (mPartitionCount > 1 && Owner(message.id, mPartitionCount) != mPartitionIndex)
+			return;
+
 		auto it = mCallbacks.find(message.id);
 		if (it != mCallbacks.end())
 			locked = it->second.lock();
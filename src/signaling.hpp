@@ -45,6 +45,11 @@ public:
 	void send(Message message);
 	Token recv(string id, Callback recvCallback);
 
+	// Only dispatch messages from peers owned by partition index out of count
+	void partition(unsigned index, unsigned count);
+
+	static unsigned Owner(const string &id, unsigned count);
+
 private:
 	void onOpen();
 	void onClosed();
@@ -63,6 +68,9 @@ private:
 
 	std::queue<string> mOutgoing;
 
+	unsigned mPartitionIndex = 0;
+	unsigned mPartitionCount = 1;
+
 	std::mutex mMutex;
 };
 